@@ -1,6 +1,7 @@
 #pragma once
 
 #include <arpa/inet.h>
+#include <array>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -34,6 +35,9 @@ class Audio {
 
   void reset();
 
+  // Print header details while loading
+  void set_verbose(bool verbose);
+
   bool mono() const;
   bool stereo() const;
 
@@ -44,6 +48,7 @@ class Audio {
   uint32_t sample_rate() const;
   uint32_t filesize() const;
   uint16_t bit_depth() const;
+  uint16_t valid_bits() const;
   uint16_t sample_freq() const;
   uint16_t block_alignment() const;
 
@@ -61,9 +66,13 @@ class Audio {
                          Endian endian = Endian::LITTLE) const;
 
   constexpr T eight_bit_samp(uint8_t samp) const;
-  constexpr T sixteen_bit_samp(int16_t samp) const;
+  static constexpr T sixteen_bit_samp(int16_t samp);
   constexpr T twenty_four_bit_samp(int32_t samp) const;
   constexpr T thirty_two_bit_samp(int32_t samp) const;
+  static constexpr T a_law_samp(uint8_t samp);
+  static constexpr T mu_law_samp(uint8_t samp);
+
+  static std::array<T, 256> const& g711_table(SmpFmt fmt);
 
   std::string fmt_from_int(uint16_t fmt) const;
 
@@ -73,6 +82,8 @@ class Audio {
   uint32_t sample_rate_;
   uint32_t filesize_;
   uint16_t bit_depth_;
+  uint16_t valid_bits_;
   uint16_t sample_freq_;
   uint16_t block_alignment_;
+  bool verbose_;
 };
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "transform.h"
+
+constexpr uint32_t TWOFOLD_MAGIC = 0x464F5754;  // "TWOF"
+
+// Limits on what a single request may ask for
+constexpr uint32_t MAX_PATH_PAYLOAD = 4096;
+constexpr uint32_t MAX_PCM_SAMPLES = 1 << 24;
+constexpr uint64_t MAX_FILE_SIZE = MAX_PCM_SAMPLES * sizeof(float);
+constexpr uint32_t MAX_SAMPLING_RATE = 768000;
+constexpr double MAX_FFT_LENGTH = 1 << 20;
+constexpr double MAX_ZOOM_RATIO = 4096;
+constexpr uint32_t MAX_WORKERS = 256;
+constexpr int REQUEST_TIMEOUT_S = 10;
+
+enum class RequestSource : uint8_t { FILE_PATH, PCM };
+
+enum ResponseStatus : int32_t {
+  STATUS_OK = 0,
+  STATUS_INVALID = -1,
+  STATUS_LOAD_FAILED = -2,
+  STATUS_TOO_LARGE = -3,
+  STATUS_BUSY = -4,
+};
+
+typedef std::chrono::steady_clock::time_point Deadline;
+
+// Wire format, little endian. A request header is followed by payload_size
+// bytes holding either a file path or mono 32 bit float PCM. A response
+// header is followed by rows (t, f, v) triples of doubles.
+#pragma pack(push, 1)
+struct RequestHeader {
+  uint32_t magic;
+  uint8_t source;
+  uint8_t mode;
+  uint8_t window;
+  uint8_t get_db;
+  uint32_t sampling_rate;
+  double target_interval;
+  double overlap;
+  double band_lo;
+  double band_hi;
+  uint32_t payload_size;
+};
+
+struct ResponseHeader {
+  uint32_t magic;
+  int32_t status;
+  uint32_t N;
+  uint32_t bins;
+  uint64_t rows;
+};
+#pragma pack(pop)
+
+class Server {
+ public:
+  Server(std::string socket_path, uint32_t workers);
+  ~Server();
+
+  bool run();
+  void stop();
+
+ private:
+  typedef std::tuple<uint8_t, uint8_t, uint8_t, uint32_t, double, double,
+                     double, double>
+      PlanKey;
+
+  void work();
+  void handle(int fd);
+
+  bool valid(RequestHeader const& req, uint32_t sampling_rate) const;
+
+  std::unique_ptr<Transformer> acquire(PlanKey const& key);
+  void release(PlanKey const& key, std::unique_ptr<Transformer> t);
+
+  std::string socket_path_;
+  uint32_t workers_;
+  int fd_;
+  std::atomic<bool> running_;
+
+  std::vector<std::thread> threads_;
+  std::queue<int> pending_;
+  size_t max_pending_;
+  std::mutex pending_mutex_;
+  std::condition_variable pending_cv_;
+
+  // Idle transformers kept warm between requests, most recently used first.
+  // The least recently used ones are dropped past max_idle_
+  std::list<std::pair<PlanKey, std::unique_ptr<Transformer>>> idle_;
+  size_t max_idle_;
+  std::mutex idle_mutex_;
+
+  // The FFTW planner is not thread safe
+  std::mutex planner_mutex_;
+};
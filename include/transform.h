@@ -7,17 +7,33 @@
 #include <vector>
 #include "window.h"
 
+enum class TransformMode { STFT, REASSIGNED, ZOOM };
+
 class Transformer {
  public:
   Transformer(double target_interval, uint32_t sampling_rate, double overlap,
-              WindowFunc func, bool get_db);
+              WindowFunc func, bool get_db,
+              TransformMode mode = TransformMode::STFT);
+  // Zoom transform restricted to the band [band_lo, band_hi] in Hz
+  Transformer(double target_interval, uint32_t sampling_rate, double overlap,
+              WindowFunc func, bool get_db, double band_lo, double band_hi);
   ~Transformer();
 
   void transform(std::vector<double>& in,
                  std::vector<std::tuple<double, double, double>>& out);
   uint32_t N();
+  uint32_t bins();
 
  private:
+  void init();
+  void design_zoom();
+
+  void transform_reassigned(
+      std::vector<double>& in,
+      std::vector<std::tuple<double, double, double>>& out);
+  void transform_zoom(std::vector<double>& in,
+                      std::vector<std::tuple<double, double, double>>& out);
+
   uint32_t N_;
   double* fftw_in_;
   std::complex<double>* fftw_out_;
@@ -28,4 +44,20 @@ class Transformer {
   fftw_plan fftw_plan_;
 
   WindowFunc func_;
+  TransformMode mode_;
+
+  // Window, time-weighted window and window derivative for reassignment
+  std::vector<double> win_h_;
+  std::vector<double> win_th_;
+  std::vector<double> win_dh_;
+
+  // Band of interest, decimation factor and mixed low-pass taps for zooming
+  double band_lo_;
+  double band_hi_;
+  uint32_t decimation_;
+  double zoom_rate_;
+  int32_t zoom_k_lo_;
+  int32_t zoom_k_hi_;
+  std::vector<double> zoom_re_;
+  std::vector<double> zoom_im_;
 };
@@ -14,3 +14,10 @@ enum class WindowFunc { RECTANGULAR, HANN };
 double win(WindowFunc func, double v, size_t I, size_t N);
 double win_rectangular(double v, size_t I, size_t N);
 double win_hann(double v, size_t I, size_t N);
+
+// Derivative of the window with respect to the sample index, scaled by v.
+// The rectangular window's derivative is taken as 0, so it carries no
+// frequency information and cannot be used for reassignment
+double dwin(WindowFunc func, double v, size_t I, size_t N);
+double dwin_rectangular(double v, size_t I, size_t N);
+double dwin_hann(double v, size_t I, size_t N);
@@ -1,6 +1,7 @@
 #include "audio.h"
 #include <arpa/inet.h>
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <chrono>
 #include <cstdint>
@@ -21,6 +22,15 @@ constexpr size_t hash(char const* str, int32_t h = 0) {
   return !str[h] ? 5381 : (hash(str, h + 1) * 33) ^ str[h];
 }
 
+// Kept as a separate function so the restrict qualifiers hold, which lets
+// the compiler auto-vectorize the loop into gathers when optimizing for a
+// target that has them (e.g. -O3 -mavx2)
+template <class T>
+void lut_decode(T* __restrict dst, T const* __restrict table,
+                uint8_t const* __restrict src, size_t len) {
+  for (size_t i = 0; i < len; i++) dst[i] = table[src[i]];
+}
+
 template <class T>
 AudioType Audio<T>::str_to_type(std::string str) {
   size_t str_h = hash(str.c_str());
@@ -40,6 +50,7 @@ Audio<T>::Audio() {
       "ERROR: Twofold does not support non floating point sample formats");
 
   format_ = AudioFmt::NOT_LOADED;
+  verbose_ = true;
 }
 
 template <class T>
@@ -100,14 +111,18 @@ bool Audio<T>::load(std::vector<uint8_t> buffer, AudioType type) {
       std::string fmt_specifier(buffer.begin(), buffer.begin() + 4);
       std::string ft_specifier(buffer.begin() + 8, buffer.begin() + 12);
 
-      printf("Found format specifier %s\n", fmt_specifier.c_str());
-      printf("Found file type specifier %s\n", ft_specifier.c_str());
+      if (verbose_) {
+        printf("Found format specifier %s\n", fmt_specifier.c_str());
+        printf("Found file type specifier %s\n", ft_specifier.c_str());
+      }
 
       size_t i_fmt = get_chunk_index(buffer, "fmt ", 12);
       size_t i_data = get_chunk_index(buffer, "data", 12);
 
-      printf("Found fmt chunk at byte %d\n", i_fmt);
-      printf("Found data chunk at byte %d\n", i_data);
+      if (verbose_) {
+        printf("Found fmt chunk at byte %d\n", i_fmt);
+        printf("Found data chunk at byte %d\n", i_data);
+      }
 
       if (i_data == -1 || i_fmt == -1 || fmt_specifier != "RIFF" ||
           ft_specifier != "WAVE") {
@@ -122,24 +137,62 @@ bool Audio<T>::load(std::vector<uint8_t> buffer, AudioType type) {
       uint16_t block_byte_rate = two_byte_int(buffer, i_fmt + 20);
       bit_depth_ = two_byte_int(buffer, i_fmt + 22);
 
-      printf("Found wave format type 0x%03x (%s)\n", audio_fmt,
-             fmt_from_int(audio_fmt).c_str());
-      printf("Found %d channel(s)\n", channels_);
-      printf("Found sample rate %d Hz\n", sample_rate_);
-      printf("Found byte rate %d B/s\n", byte_rate);
-      printf("Found block byte rate %d B/block\n", block_byte_rate);
-      printf("Found bit depth %d Bit\n", bit_depth_);
+      if (verbose_) {
+        printf("Found wave format type 0x%03x (%s)\n", audio_fmt,
+               fmt_from_int(audio_fmt).c_str());
+        printf("Found %d channel(s)\n", channels_);
+        printf("Found sample rate %d Hz\n", sample_rate_);
+        printf("Found byte rate %d B/s\n", byte_rate);
+        printf("Found block byte rate %d B/block\n", block_byte_rate);
+        printf("Found bit depth %d Bit\n", bit_depth_);
+      }
 
       uint16_t bytes_per_sample = static_cast<uint16_t>(bit_depth_) / 8;
 
+      valid_bits_ = bit_depth_;
+
+      // The actual format of an extensible file is the first two bytes of
+      // its sub-format GUID, provided the rest is the standard KSDATAFORMAT
+      // suffix. Other GUIDs (e.g. ambisonic B-format) are not plain audio
+      if (audio_fmt == SmpFmt::EXTENSIBLE) {
+        static uint8_t const guid_suffix[] = {0x00, 0x00, 0x00, 0x00, 0x10,
+                                              0x00, 0x80, 0x00, 0x00, 0xAA,
+                                              0x00, 0x38, 0x9B, 0x71};
+
+        if (i_fmt + 48 > buffer.size() ||
+            two_byte_int(buffer, i_fmt + 24) < 22) {
+          printf("ERROR: This WAVE file has a truncated extensible header");
+          return false;
+        }
+
+        if (std::memcmp(&buffer[i_fmt + 34], guid_suffix,
+                        sizeof(guid_suffix)) != 0) {
+          printf(
+              "ERROR: This WAVE file contains a sub-format currently not "
+              "supported");
+          return false;
+        }
+
+        valid_bits_ = two_byte_int(buffer, i_fmt + 26);
+        audio_fmt = two_byte_int(buffer, i_fmt + 32);
+
+        if (verbose_) {
+          printf("Found sub-format type 0x%03x (%s)\n", audio_fmt,
+                 fmt_from_int(audio_fmt).c_str());
+          printf("Found %d valid bits\n", valid_bits_);
+        }
+      }
+
       if (audio_fmt != SmpFmt::PCM && audio_fmt != SmpFmt::IEEE_FLOAT &&
-          audio_fmt != SmpFmt::EXTENSIBLE) {
+          audio_fmt != SmpFmt::A_LAW && audio_fmt != SmpFmt::MU_LAW) {
         printf(
             "ERROR: This WAVE file contains a sampling format currently not "
             "supported");
         return false;
       }
 
+      sample_format_ = static_cast<SmpFmt>(audio_fmt);
+
       if (channels_ < 1 || channels_ > 128) {
         printf("ERROR: This WAVE file contains an invalid number of channels");
         return false;
@@ -159,12 +212,56 @@ bool Audio<T>::load(std::vector<uint8_t> buffer, AudioType type) {
         return false;
       }
 
-      int32_t dat_chunk_size = four_byte_int(buffer, i_data + 4);
-      int32_t num_samples = dat_chunk_size / (channels_ * bit_depth_ / 8);
-      int32_t i_start = i_data + 8;
+      if (valid_bits_ == 0 || valid_bits_ > bit_depth_ ||
+          ((sample_format_ == SmpFmt::A_LAW ||
+            sample_format_ == SmpFmt::MU_LAW) &&
+           bit_depth_ != 8)) {
+        printf("ERROR: This WAVE file has an invalid bit depth for its format");
+        return false;
+      }
+
+      uint32_t dat_chunk_size = four_byte_int(buffer, i_data + 4);
+      uint32_t num_samples = dat_chunk_size / (channels_ * bit_depth_ / 8);
+      size_t i_start = i_data + 8;
 
       samples_.resize(channels_);
 
+      // G.711 companded samples decode through a 256 entry table, one
+      // channel at a time. Interleaved channels are split into bytes first
+      // so every channel goes through the same unit stride lookup
+      if (sample_format_ == SmpFmt::A_LAW || sample_format_ == SmpFmt::MU_LAW) {
+        // Streaming writers may leave a placeholder chunk size, so only
+        // decode the blocks that are actually present
+        size_t present = 0;
+        if (i_start < buffer.size())
+          present = (buffer.size() - i_start) / block_byte_rate;
+        size_t len = std::min<size_t>(num_samples, present);
+
+        if (len == 0) {
+          printf("ERROR: This WAVE file contains no samples");
+          return false;
+        }
+
+        T const* table = g711_table(sample_format_).data();
+        std::vector<uint8_t> channel;
+
+        for (uint16_t c = 0; c < channels_; c++) {
+          samples_[c].resize(len);
+
+          uint8_t const* src = buffer.data() + i_start + c;
+
+          if (channels_ > 1) {
+            channel.resize(len);
+            for (size_t i = 0; i < len; i++) channel[i] = src[i * channels_];
+            src = channel.data();
+          }
+
+          lut_decode(samples_[c].data(), table, src, len);
+        }
+
+        return true;
+      }
+
       for (size_t i = 0; i < num_samples; i++) {
         for (uint16_t c = 0; c < channels_; c++) {
           size_t i_samp =
@@ -228,6 +325,7 @@ void Audio<T>::reset() {
   sample_rate_ = 0;
   filesize_ = 0;
   bit_depth_ = 0;
+  valid_bits_ = 0;
   sample_freq_ = 0;
   block_alignment_ = 0;
   samples_.clear();
@@ -263,6 +361,11 @@ std::vector<T> Audio<T>::samples(uint8_t channel) const {
   return samples_[channel];
 }
 
+template <class T>
+void Audio<T>::set_verbose(bool verbose) {
+  verbose_ = verbose;
+}
+
 template <class T>
 bool Audio<T>::mono() const {
   return channels_ == 1;
@@ -308,6 +411,11 @@ uint16_t Audio<T>::bit_depth() const {
   return bit_depth_;
 }
 
+template <class T>
+uint16_t Audio<T>::valid_bits() const {
+  return valid_bits_;
+}
+
 template <class T>
 uint16_t Audio<T>::sample_freq() const {
   return sample_freq_;
@@ -343,7 +451,7 @@ constexpr T Audio<T>::eight_bit_samp(uint8_t samp) const {
 }
 
 template <class T>
-constexpr T Audio<T>::sixteen_bit_samp(int16_t samp) const {
+constexpr T Audio<T>::sixteen_bit_samp(int16_t samp) {
   return static_cast<T>(samp) /
          static_cast<T>(std::numeric_limits<int16_t>::max());
 }
@@ -362,6 +470,45 @@ constexpr T Audio<T>::thirty_two_bit_samp(int32_t samp) const {
                    static_cast<T>(std::numeric_limits<int32_t>::max());
 }
 
+template <class T>
+constexpr T Audio<T>::a_law_samp(uint8_t samp) {
+  uint8_t a = samp ^ 0x55;
+  int16_t exponent = (a >> 4) & 0x07;
+  int16_t mantissa = a & 0x0F;
+  int16_t magnitude = exponent == 0
+                          ? (mantissa << 4) + 0x08
+                          : ((mantissa << 4) + 0x108) << (exponent - 1);
+
+  return sixteen_bit_samp(a & 0x80 ? magnitude : -magnitude);
+}
+
+template <class T>
+constexpr T Audio<T>::mu_law_samp(uint8_t samp) {
+  uint8_t u = ~samp;
+  int16_t exponent = (u >> 4) & 0x07;
+  int16_t mantissa = u & 0x0F;
+  int16_t magnitude = (((mantissa << 3) + 0x84) << exponent) - 0x84;
+
+  return sixteen_bit_samp(u & 0x80 ? -magnitude : magnitude);
+}
+
+template <class T>
+std::array<T, 256> const& Audio<T>::g711_table(SmpFmt fmt) {
+  static std::array<T, 256> const a_law = [] {
+    std::array<T, 256> table;
+    for (size_t i = 0; i < 256; i++) table[i] = a_law_samp(i);
+    return table;
+  }();
+
+  static std::array<T, 256> const mu_law = [] {
+    std::array<T, 256> table;
+    for (size_t i = 0; i < 256; i++) table[i] = mu_law_samp(i);
+    return table;
+  }();
+
+  return fmt == SmpFmt::A_LAW ? a_law : mu_law;
+}
+
 template <class T>
 uint16_t Audio<T>::two_byte_int(std::vector<uint8_t>& buffer, size_t index,
                                 Endian endian) const {
@@ -0,0 +1,441 @@
+#include "server.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "audio.h"
+#include "transform.h"
+#include "window.h"
+
+// Waits until fd is ready for events or the deadline passes
+bool wait_for(int fd, short events, Deadline deadline) {
+  while (true) {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now())
+                    .count();
+
+    if (left <= 0) return false;
+
+    pollfd p = {fd, events, 0};
+    int r = poll(&p, 1, static_cast<int>(left));
+
+    if (r < 0 && errno == EINTR) continue;
+
+    return r > 0;
+  }
+}
+
+Deadline request_deadline() {
+  return std::chrono::steady_clock::now() +
+         std::chrono::seconds(REQUEST_TIMEOUT_S);
+}
+
+bool read_all(int fd, void* buf, size_t len, Deadline deadline) {
+  uint8_t* p = static_cast<uint8_t*>(buf);
+
+  while (len > 0) {
+    if (!wait_for(fd, POLLIN, deadline)) return false;
+
+    ssize_t n = recv(fd, p, len, MSG_DONTWAIT);
+
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+    if (n <= 0) return false;
+
+    p += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+bool write_all(int fd, void const* buf, size_t len, Deadline deadline) {
+  uint8_t const* p = static_cast<uint8_t const*>(buf);
+
+  while (len > 0) {
+    if (!wait_for(fd, POLLOUT, deadline)) return false;
+
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+    if (n <= 0) return false;
+
+    p += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+bool write_status(int fd, int32_t status) {
+  ResponseHeader res = {TWOFOLD_MAGIC, status, 0, 0, 0};
+  return write_all(fd, &res, sizeof(res), request_deadline());
+}
+
+Server::Server(std::string socket_path, uint32_t workers) {
+  socket_path_ = socket_path;
+  workers_ = std::max(1u, std::min(workers, MAX_WORKERS));
+  max_idle_ = std::max<size_t>(8, 2 * workers_);
+  max_pending_ = 16 * workers_;
+  fd_ = -1;
+  running_ = false;
+}
+
+Server::~Server() {
+  stop();
+
+  for (std::thread& t : threads_) t.join();
+}
+
+bool Server::run() {
+  if (socket_path_.size() >= sizeof(sockaddr_un::sun_path)) {
+    printf("ERROR: Socket path %s is too long\n", socket_path_.c_str());
+    return false;
+  }
+
+  fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd_ < 0) {
+    printf("ERROR: Could not create socket (%s)\n", std::strerror(errno));
+    return false;
+  }
+
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+
+  // Only ever replace a stale socket, never some other file
+  struct stat st;
+
+  if (lstat(socket_path_.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      printf("ERROR: %s exists and is not a socket\n", socket_path_.c_str());
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+
+    unlink(socket_path_.c_str());
+  }
+
+  // Anyone who can connect can have the daemon read files on their behalf,
+  // so the socket is only accessible to its owner
+  mode_t mask = umask(0177);
+  int bound = bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  umask(mask);
+
+  if (bound < 0 || chmod(socket_path_.c_str(), 0600) < 0 ||
+      listen(fd_, SOMAXCONN) < 0) {
+    printf("ERROR: Could not listen on %s (%s)\n", socket_path_.c_str(),
+           std::strerror(errno));
+    close(fd_);
+    fd_ = -1;
+    return false;
+  }
+
+  running_ = true;
+
+  for (uint32_t i = 0; i < workers_; i++)
+    threads_.push_back(std::thread(&Server::work, this));
+
+  printf("Listening on %s with %d worker(s)\n", socket_path_.c_str(),
+         workers_);
+
+  bool ok = true;
+
+  while (running_) {
+    int client = accept(fd_, nullptr, nullptr);
+
+    if (client < 0) {
+      if (!running_) break;
+
+      switch (errno) {
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+          continue;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+          // Out of descriptors or memory, give workers a moment to free some
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+          continue;
+        default:
+          printf("ERROR: Could not accept connection (%s)\n",
+                 std::strerror(errno));
+          ok = false;
+          break;
+      }
+
+      break;
+    }
+
+    bool queued = false;
+
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex_);
+
+      if (pending_.size() < max_pending_) {
+        pending_.push(client);
+        queued = true;
+      }
+    }
+
+    if (!queued) {
+      write_status(client, STATUS_BUSY);
+      close(client);
+      continue;
+    }
+
+    pending_cv_.notify_one();
+  }
+
+  stop();
+
+  return ok;
+}
+
+void Server::stop() {
+  bool was_running;
+
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    was_running = running_.exchange(false);
+  }
+
+  pending_cv_.notify_all();
+
+  if (fd_ >= 0) {
+    shutdown(fd_, SHUT_RDWR);
+    close(fd_);
+    fd_ = -1;
+  }
+
+  if (was_running) unlink(socket_path_.c_str());
+}
+
+void Server::work() {
+  while (true) {
+    int client;
+
+    {
+      std::unique_lock<std::mutex> lock(pending_mutex_);
+      pending_cv_.wait(lock, [this] { return !running_ || !pending_.empty(); });
+
+      if (pending_.empty()) return;
+
+      client = pending_.front();
+      pending_.pop();
+    }
+
+    // Keep one failing request from taking the whole pool down
+    try {
+      handle(client);
+    } catch (std::exception const& e) {
+      printf("ERROR: Request failed (%s)\n", e.what());
+    } catch (...) {
+      printf("ERROR: Request failed\n");
+    }
+
+    close(client);
+  }
+}
+
+void Server::handle(int fd) {
+  RequestHeader req;
+
+  // The whole request has to arrive within the timeout, however slowly
+  // the client trickles it in
+  Deadline deadline = request_deadline();
+
+  if (!read_all(fd, &req, sizeof(req), deadline)) return;
+
+  if (req.magic != TWOFOLD_MAGIC ||
+      req.source > static_cast<uint8_t>(RequestSource::PCM) ||
+      req.mode > static_cast<uint8_t>(TransformMode::ZOOM) ||
+      req.window > static_cast<uint8_t>(WindowFunc::HANN) ||
+      !std::isfinite(req.target_interval) || req.target_interval <= 0.0 ||
+      !std::isfinite(req.overlap) || !std::isfinite(req.band_lo) ||
+      !std::isfinite(req.band_hi)) {
+    printf("ERROR: Invalid request header\n");
+    write_status(fd, STATUS_INVALID);
+    return;
+  }
+
+  uint32_t max_payload = req.source == static_cast<uint8_t>(RequestSource::PCM)
+                             ? MAX_PCM_SAMPLES * sizeof(float)
+                             : MAX_PATH_PAYLOAD;
+
+  if (req.payload_size > max_payload) {
+    printf("ERROR: Request payload too large\n");
+    write_status(fd, STATUS_TOO_LARGE);
+    return;
+  }
+
+  std::vector<uint8_t> payload(req.payload_size);
+
+  if (!read_all(fd, payload.data(), payload.size(), deadline)) return;
+
+  // Buffers stay with the worker thread so repeated requests reuse them
+  thread_local std::vector<double> in;
+  thread_local std::vector<std::tuple<double, double, double>> out;
+
+  uint32_t sampling_rate = req.sampling_rate;
+
+  switch (static_cast<RequestSource>(req.source)) {
+    case RequestSource::FILE_PATH: {
+      std::string path(payload.begin(), payload.end());
+      struct stat st;
+
+      // Loading copies the file several times, so hold it to the PCM limit
+      if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+        write_status(fd, STATUS_LOAD_FAILED);
+        return;
+      }
+
+      if (static_cast<uint64_t>(st.st_size) > MAX_FILE_SIZE) {
+        printf("ERROR: Requested file too large\n");
+        write_status(fd, STATUS_TOO_LARGE);
+        return;
+      }
+
+      Audio<float> a;
+      a.set_verbose(false);
+
+      if (!a.load(path)) {
+        write_status(fd, STATUS_LOAD_FAILED);
+        return;
+      }
+
+      std::vector<float> samp = a.samples(0);
+      in.assign(samp.begin(), samp.end());
+      sampling_rate = a.sample_rate();
+      break;
+    }
+    case RequestSource::PCM: {
+      in.resize(payload.size() / sizeof(float));
+
+      for (size_t i = 0; i < in.size(); i++) {
+        float samp;
+        std::memcpy(&samp, &payload[i * sizeof(float)], sizeof(float));
+        in[i] = samp;
+      }
+      break;
+    }
+  }
+
+  if (!valid(req, sampling_rate)) {
+    printf("ERROR: Invalid transform parameters\n");
+    write_status(fd, STATUS_INVALID);
+    return;
+  }
+
+  // Normalize the key so equivalent requests share transformers
+  bool zoom = req.mode == static_cast<uint8_t>(TransformMode::ZOOM);
+
+  PlanKey key(req.mode, req.window, req.get_db != 0, sampling_rate,
+              req.target_interval, std::max(0.0, std::min(req.overlap, 0.5)),
+              zoom ? req.band_lo : 0.0, zoom ? req.band_hi : 0.0);
+
+  std::unique_ptr<Transformer> t = acquire(key);
+
+  t->transform(in, out);
+
+  ResponseHeader res = {TWOFOLD_MAGIC, STATUS_OK, t->N(), t->bins(),
+                        out.size()};
+
+  release(key, std::move(t));
+
+  deadline = request_deadline();
+
+  if (!write_all(fd, &res, sizeof(res), deadline)) return;
+
+  std::vector<double> row(3 * out.size());
+
+  for (size_t i = 0; i < out.size(); i++) {
+    row[3 * i] = std::get<0>(out[i]);
+    row[3 * i + 1] = std::get<1>(out[i]);
+    row[3 * i + 2] = std::get<2>(out[i]);
+  }
+
+  write_all(fd, row.data(), row.size() * sizeof(double), deadline);
+}
+
+bool Server::valid(RequestHeader const& req, uint32_t sampling_rate) const {
+  if (sampling_rate == 0 || sampling_rate > MAX_SAMPLING_RATE) return false;
+  if (req.target_interval * sampling_rate > MAX_FFT_LENGTH) return false;
+
+  if (req.mode == static_cast<uint8_t>(TransformMode::REASSIGNED) &&
+      req.window == static_cast<uint8_t>(WindowFunc::RECTANGULAR))
+    return false;
+
+  if (req.mode == static_cast<uint8_t>(TransformMode::ZOOM)) {
+    double bw = req.band_hi - req.band_lo;
+
+    if (req.band_lo < 0.0 || req.band_hi > sampling_rate / 2.0 || bw <= 0.0 ||
+        sampling_rate / bw > MAX_ZOOM_RATIO)
+      return false;
+  }
+
+  return true;
+}
+
+std::unique_ptr<Transformer> Server::acquire(PlanKey const& key) {
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+
+    for (auto it = idle_.begin(); it != idle_.end(); ++it) {
+      if (it->first != key) continue;
+
+      std::unique_ptr<Transformer> t = std::move(it->second);
+      idle_.erase(it);
+      return t;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(planner_mutex_);
+
+  TransformMode mode = static_cast<TransformMode>(std::get<0>(key));
+  WindowFunc func = static_cast<WindowFunc>(std::get<1>(key));
+
+  if (mode == TransformMode::ZOOM)
+    return std::unique_ptr<Transformer>(new Transformer(
+        std::get<4>(key), std::get<3>(key), std::get<5>(key), func,
+        std::get<2>(key), std::get<6>(key), std::get<7>(key)));
+
+  return std::unique_ptr<Transformer>(
+      new Transformer(std::get<4>(key), std::get<3>(key), std::get<5>(key),
+                      func, std::get<2>(key), mode));
+}
+
+void Server::release(PlanKey const& key, std::unique_ptr<Transformer> t) {
+  std::unique_ptr<Transformer> evicted;
+
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex_);
+    idle_.emplace_front(key, std::move(t));
+
+    if (idle_.size() > max_idle_) {
+      evicted = std::move(idle_.back().second);
+      idle_.pop_back();
+    }
+  }
+
+  // Destroying a plan goes through the planner as well
+  if (evicted) {
+    std::lock_guard<std::mutex> lock(planner_mutex_);
+    evicted.reset();
+  }
+}
@@ -1,82 +1,277 @@
 #include "transform.h"
 #include <fftw3.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <tuple>
 #include <vector>
 #include "window.h"
 
-uint32_t closest_pow2(uint32_t x) {
-  uint32_t p2a = x == 1 ? 1 : 1 << (32 - __builtin_clz(x - 1));
-  uint32_t p2b = p2a >> 1;
+// Transforms running right now and transforms started so far. Size timings
+// taken while other transforms run are skewed, so they are not cached
+std::atomic<uint32_t> active_transforms(0);
+std::atomic<uint64_t> started_transforms(0);
 
-  return (p2a - x) > (x - p2b) ? p2b : p2a;
+struct ActiveTransform {
+  ActiveTransform() {
+    active_transforms++;
+    started_transforms++;
+  }
+  ~ActiveTransform() { active_transforms--; }
+};
+
+std::filesystem::path temp_file(const char* name) {
+  return std::filesystem::temp_directory_path() / std::filesystem::path(name);
 }
 
-uint32_t closest_powk(uint32_t x, uint8_t k) {
-  uint32_t log = std::log(x) / std::log(k);
+std::vector<uint32_t> smooth_sizes(uint32_t lo, uint32_t hi) {
+  std::vector<uint32_t> v;
 
-  uint32_t a = std::pow(k, log);
-  uint32_t b = std::pow(k, log + 1);
+  for (uint64_t a = 1; a <= hi; a *= 2)
+    for (uint64_t b = a; b <= hi; b *= 3)
+      for (uint64_t c = b; c <= hi; c *= 5)
+        for (uint64_t d = c; d <= hi; d *= 7)
+          if (d >= lo) v.push_back(static_cast<uint32_t>(d));
 
-  return ((a - x) > (x - b) ? b : a);
+  std::sort(v.begin(), v.end());
+
+  return v;
 }
 
-uint32_t closest_i(std::vector<uint32_t>& v, uint32_t d) {
-  auto it = std::lower_bound(v.begin(), v.end(), d);
-  if (it == v.begin())
-    it = v.end();
-  else
-    --it;
-  auto jt = std::upper_bound(v.begin(), v.end(), d), out = it;
-  if (it == v.end() || jt != v.end() && d - *it > *jt - d) out = jt;
-  return *out;
+double time_per_sample(uint32_t n, bool complex, int batch) {
+  int len = n;
+  int bins = complex ? n : n / 2 + 1;
+
+  double* in = new double[complex ? 2 * n * batch : n * batch];
+  std::complex<double>* out = new std::complex<double>[bins * batch];
+
+  // Plan the same shape the transformer will execute
+  fftw_plan plan =
+      complex ? fftw_plan_many_dft(
+                    1, &len, batch, reinterpret_cast<fftw_complex*>(in),
+                    nullptr, 1, len, reinterpret_cast<fftw_complex*>(out),
+                    nullptr, 1, bins, FFTW_FORWARD, FFTW_MEASURE)
+              : fftw_plan_many_dft_r2c(
+                    1, &len, batch, in, nullptr, 1, len,
+                    reinterpret_cast<fftw_complex*>(out), nullptr, 1, bins,
+                    FFTW_MEASURE);
+
+  size_t in_len = complex ? 2 * n * batch : n * batch;
+  for (size_t i = 0; i < in_len; i++) in[i] = std::sin(static_cast<double>(i));
+
+  fftw_execute(plan);
+
+  uint32_t reps = std::max(8u, (1u << 20) / (n * batch));
+  double best = std::numeric_limits<double>::max();
+
+  // Best of several runs, so one noisy run does not end up in the cache
+  for (size_t run = 0; run < 5; run++) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < reps; i++) fftw_execute(plan);
+    auto end = std::chrono::steady_clock::now();
+
+    best = std::min(best, std::chrono::duration<double>(end - start).count());
+  }
+
+  fftw_destroy_plan(plan);
+  delete[] in;
+  delete[] out;
+
+  return best / (static_cast<double>(reps) * n);
 }
 
-uint32_t get_best_n(double target_interval, uint32_t sampling_rate) {
+uint32_t get_best_n(double target_interval, uint32_t sampling_rate,
+                    bool complex, int batch) {
   if (target_interval <= 0.0) {
     printf("ERROR: target_interval should be greater than 0\n");
     return 0;
   }
 
-  // FFTW is fastest when working with numbers in the form 2^a, 3^b, 5^c, or 7^d
+  uint32_t target = std::max(
+      2u, static_cast<uint32_t>(std::round(sampling_rate * target_interval)));
+
+  std::filesystem::path cache_path =
+      temp_file("twofold_fftw_plan_sizes.cache");
+
+  // Sizes are cached per target length and plan shape
+  typedef std::tuple<uint32_t, bool, int> CacheKey;
+
+  std::map<CacheKey, uint32_t> cache;
+  std::ifstream cache_in(cache_path);
+  uint32_t cached_target, cached_n;
+  bool cached_complex;
+  int cached_batch;
+
+  while (cache_in >> cached_target >> cached_complex >> cached_batch >>
+         cached_n)
+    cache[CacheKey(cached_target, cached_complex, cached_batch)] = cached_n;
+
+  CacheKey key(target, complex, batch);
+
+  if (cache.count(key)) return cache[key];
+
+  // FFTW is fastest on sizes of the form 2^a 3^b 5^c 7^d. Every such size
+  // within 1/16 of the target is a candidate, falling back to the nearest
+  // ones when the window holds none
+  std::vector<uint32_t> vn = smooth_sizes(target - target / 16,
+                                          target + target / 16);
+
+  if (vn.empty()) {
+    std::vector<uint32_t> near = smooth_sizes(target / 2, target * 2);
+    auto it = std::lower_bound(near.begin(), near.end(), target);
+
+    if (it != near.end()) vn.push_back(*it);
+    if (it != near.begin()) vn.push_back(*(it - 1));
+  }
+
+  uint64_t started = started_transforms;
+  bool quiet = active_transforms == 0;
 
-  uint32_t target =
-      static_cast<uint32_t>(std::round(sampling_rate * target_interval));
+  // Rank by measured time per sample, which is what a whole spectrogram
+  // costs for a fixed input length
+  uint32_t best = vn[0];
+  double best_t = std::numeric_limits<double>::max();
 
-  std::vector<uint32_t> vn = {closest_pow2(target), closest_powk(target, 3),
-                              closest_powk(target, 5), closest_powk(target, 7)};
+  for (uint32_t n : vn) {
+    double t = time_per_sample(n, complex, batch);
 
-  std::sort(vn.begin(), vn.end());
+    if (t < best_t) {
+      best_t = t;
+      best = n;
+    }
+  }
+
+  if (!quiet || active_transforms != 0 || started_transforms != started)
+    return best;
+
+  std::ofstream cache_out(cache_path, std::ios_base::app);
+  cache_out << target << " " << complex << " " << batch << " " << best
+            << std::endl;
+
+  return best;
+}
+
+Transformer::Transformer(double target_interval, uint32_t sampling_rate,
+                         double overlap, WindowFunc func, bool get_db,
+                         TransformMode mode) {
+  target_interval_ = target_interval;
+  sampling_rate_ = sampling_rate;
+  overlap_ = overlap;
+  get_db_ = get_db;
+  func_ = func;
+  mode_ = mode;
+  band_lo_ = 0.0;
+  band_hi_ = sampling_rate_ / 2.0;
 
-  return closest_i(vn, target);
+  init();
 }
 
 Transformer::Transformer(double target_interval, uint32_t sampling_rate,
-                         double overlap, WindowFunc func, bool get_db) {
+                         double overlap, WindowFunc func, bool get_db,
+                         double band_lo, double band_hi) {
   target_interval_ = target_interval;
   sampling_rate_ = sampling_rate;
   overlap_ = overlap;
   get_db_ = get_db;
   func_ = func;
+  mode_ = TransformMode::ZOOM;
+  band_lo_ = std::max(0.0, band_lo);
+  band_hi_ = std::min(sampling_rate_ / 2.0, band_hi);
+
+  if (band_hi_ <= band_lo_) {
+    printf("ERROR: Invalid zoom band, using the full band instead\n");
+    band_lo_ = 0.0;
+    band_hi_ = sampling_rate_ / 2.0;
+  }
+
+  init();
+}
 
-  N_ = get_best_n(target_interval_, sampling_rate_);
+void Transformer::init() {
+  if (mode_ == TransformMode::REASSIGNED &&
+      func_ == WindowFunc::RECTANGULAR) {
+    printf(
+        "ERROR: Reassignment needs a tapered window, falling back to a plain "
+        "STFT\n");
+    mode_ = TransformMode::STFT;
+  }
 
-  fftw_in_ = new double[N_];
-  fftw_out_ = new std::complex<double>[N_];
+  decimation_ = 1;
+  zoom_rate_ = sampling_rate_;
 
-  std::filesystem::path path = std::filesystem::temp_directory_path();
-  std::filesystem::path file("twofold_fftw_dft_r2c_1d.wis");
+  if (mode_ == TransformMode::ZOOM) {
+    // Keep headroom above the band width for the filter's transition
+    double bw = band_hi_ - band_lo_;
+    decimation_ =
+        std::max(1u, static_cast<uint32_t>(sampling_rate_ / (1.5 * bw)));
+    zoom_rate_ = static_cast<double>(sampling_rate_) / decimation_;
+  }
 
-  std::filesystem::path full_path = path / file;
+  std::filesystem::path full_path = temp_file("twofold_fftw_dft_r2c_1d.wis");
 
   if (std::filesystem::exists(full_path))
     fftw_import_wisdom_from_filename(full_path.c_str());
 
-  fftw_plan_ = fftw_plan_dft_r2c_1d(
-      N_, fftw_in_, reinterpret_cast<fftw_complex*>(fftw_out_), FFTW_PATIENT);
+  N_ = get_best_n(target_interval_,
+                  static_cast<uint32_t>(std::round(zoom_rate_)),
+                  mode_ == TransformMode::ZOOM,
+                  mode_ == TransformMode::REASSIGNED ? 3 : 1);
+
+  switch (mode_) {
+    case TransformMode::STFT: {
+      fftw_in_ = new double[N_];
+      fftw_out_ = new std::complex<double>[N_];
+
+      fftw_plan_ = fftw_plan_dft_r2c_1d(
+          N_, fftw_in_, reinterpret_cast<fftw_complex*>(fftw_out_),
+          FFTW_PATIENT);
+      break;
+    }
+    case TransformMode::REASSIGNED: {
+      // The three windowed copies of a frame sit back to back so that a
+      // single batched plan transforms all of them
+      int n = N_;
+      int bins = N_ / 2 + 1;
+
+      fftw_in_ = new double[3 * N_];
+      fftw_out_ = new std::complex<double>[3 * bins];
+
+      fftw_plan_ = fftw_plan_many_dft_r2c(
+          1, &n, 3, fftw_in_, nullptr, 1, n,
+          reinterpret_cast<fftw_complex*>(fftw_out_), nullptr, 1, bins,
+          FFTW_PATIENT);
+
+      win_h_.resize(N_);
+      win_th_.resize(N_);
+      win_dh_.resize(N_);
+
+      for (size_t j = 0; j < N_; j++) {
+        win_h_[j] = win(func_, 1.0, j, N_);
+        win_th_[j] = (static_cast<double>(j) - N_ / 2.0) * win_h_[j];
+        win_dh_[j] = dwin(func_, 1.0, j, N_);
+      }
+      break;
+    }
+    case TransformMode::ZOOM: {
+      fftw_in_ = new double[2 * N_];
+      fftw_out_ = new std::complex<double>[N_];
+
+      fftw_plan_ = fftw_plan_dft_1d(
+          N_, reinterpret_cast<fftw_complex*>(fftw_in_),
+          reinterpret_cast<fftw_complex*>(fftw_out_), FFTW_FORWARD,
+          FFTW_PATIENT);
+
+      design_zoom();
+      break;
+    }
+  }
 
   fftw_export_wisdom_to_filename(full_path.c_str());
 }
@@ -87,9 +282,73 @@ Transformer::~Transformer() {
   fftw_destroy_plan(fftw_plan_);
 }
 
+void Transformer::design_zoom() {
+  // Windowed sinc low-pass. Anything from zoom_rate_ - bw / 2 up aliases
+  // back into the band after decimation, so the transition has to fit
+  // between the band edge and there. The cutoff sits halfway and the tap
+  // count follows from the Blackman transition width of about 5.5 / taps
+  double bw = band_hi_ - band_lo_;
+  double pass = bw / 2.0;
+  double stop = zoom_rate_ - bw / 2.0;
+
+  uint32_t taps = 1;
+  if (decimation_ > 1)
+    taps = static_cast<uint32_t>(
+               std::ceil(5.5 * sampling_rate_ / (stop - pass))) |
+           1;
+
+  double half = (taps - 1) / 2.0;
+  double cutoff = (pass + stop) / 2.0 / sampling_rate_;
+  double omega = M_PI * (band_lo_ + band_hi_) / sampling_rate_;
+
+  std::vector<double> h(taps);
+  double sum = 0.0;
+
+  for (size_t j = 0; j < taps; j++) {
+    double x = j - half;
+    double sinc = x == 0.0 ? 1.0 : std::sin(2 * M_PI * cutoff * x) /
+                                       (2 * M_PI * cutoff * x);
+    double blackman =
+        taps == 1 ? 1.0
+                  : 0.42 - 0.5 * std::cos(2 * M_PI * j / (taps - 1)) +
+                        0.08 * std::cos(4 * M_PI * j / (taps - 1));
+
+    h[j] = sinc * blackman;
+    sum += h[j];
+  }
+
+  // Fold the mix down to baseband into the taps, so the filter only has to
+  // be evaluated at the decimated output positions
+  zoom_re_.resize(taps);
+  zoom_im_.resize(taps);
+
+  for (size_t j = 0; j < taps; j++) {
+    zoom_re_[j] = h[j] / sum * std::cos(omega * (j - half));
+    zoom_im_[j] = -h[j] / sum * std::sin(omega * (j - half));
+  }
+
+  win_h_.resize(N_);
+  for (size_t j = 0; j < N_; j++) win_h_[j] = win(func_, 1.0, j, N_);
+
+  // Signed FFT bins that fall inside the requested band
+  double fc = (band_lo_ + band_hi_) / 2.0;
+  double df = zoom_rate_ / N_;
+
+  zoom_k_lo_ = std::max(-static_cast<int32_t>(N_ / 2),
+                        static_cast<int32_t>(std::ceil((band_lo_ - fc) / df)));
+  zoom_k_hi_ =
+      std::min(static_cast<int32_t>((N_ - 1) / 2),
+               static_cast<int32_t>(std::floor((band_hi_ - fc) / df)));
+}
+
 void Transformer::transform(
     std::vector<double>& in,
     std::vector<std::tuple<double, double, double>>& out) {
+  ActiveTransform active;
+
+  if (mode_ == TransformMode::REASSIGNED) return transform_reassigned(in, out);
+  if (mode_ == TransformMode::ZOOM) return transform_zoom(in, out);
+
   out.clear();
 
   double overlap = std::max(0.0, std::min(overlap_, 0.5));
@@ -132,4 +391,160 @@ void Transformer::transform(
   }
 }
 
+void Transformer::transform_reassigned(
+    std::vector<double>& in,
+    std::vector<std::tuple<double, double, double>>& out) {
+  out.clear();
+
+  double overlap = std::max(0.0, std::min(overlap_, 0.5));
+  uint32_t hop = N_ - static_cast<uint32_t>(overlap * N_);
+  uint32_t bins = N_ / 2 + 1;
+
+  size_t frames = (in.size() + hop - 1) / hop;
+
+  double* in_th = fftw_in_ + N_;
+  double* in_dh = fftw_in_ + 2 * N_;
+
+  std::complex<double>* out_h = fftw_out_;
+  std::complex<double>* out_th = fftw_out_ + bins;
+  std::complex<double>* out_dh = fftw_out_ + 2 * bins;
+
+  // Energy is scattered into this grid as each frame is transformed, so
+  // no per-frame spectra are kept around
+  std::vector<double> grid(frames * bins, 0.0);
+
+  for (size_t fr = 0; fr < frames; fr++) {
+    size_t i = fr * hop;
+
+    for (size_t j = 0; j < N_; j++) {
+      double v = i + j < in.size() ? in[i + j] : 0.0;
+
+      fftw_in_[j] = v * win_h_[j];
+      in_th[j] = v * win_th_[j];
+      in_dh[j] = v * win_dh_[j];
+    }
+
+    fftw_execute(fftw_plan_);
+
+    for (size_t k = 0; k < bins; k++) {
+      std::complex<double> c = out_h[k];
+      double v = std::norm(c);
+
+      if (v == 0.0) continue;
+
+      // Offsets from the frame in samples and from the bin in bins
+      double dt = std::real(out_th[k] * std::conj(c)) / v;
+      double dk = -std::imag(out_dh[k] * std::conj(c)) / v * N_ / (2 * M_PI);
+
+      double t_r = std::round(fr + dt / hop);
+      double k_r = std::round(k + dk);
+
+      if (t_r < 0 || t_r >= frames || k_r < 0 || k_r >= bins) continue;
+
+      grid[static_cast<size_t>(t_r) * bins + static_cast<size_t>(k_r)] += v;
+    }
+  }
+
+  // Reassigned times are offsets from the window centre, so rows are
+  // labelled at frame centres rather than frame starts
+  double real_hop = static_cast<double>(hop) / sampling_rate_;
+  double centre = N_ / 2.0 / sampling_rate_;
+  double df = static_cast<double>(sampling_rate_) / N_;
+
+  out.reserve(grid.size());
+
+  for (size_t fr = 0; fr < frames; fr++) {
+    for (size_t k = 0; k < bins; k++) {
+      double v = grid[fr * bins + k];
+
+      // Most cells of a reassigned grid are empty, keep them finite
+      if (get_db_)
+        v = 10 * std::log10(std::max(v, std::numeric_limits<double>::min()));
+
+      out.push_back(
+          std::tuple<double, double, double>(fr * real_hop + centre, k * df,
+                                             v));
+    }
+  }
+}
+
+void Transformer::transform_zoom(
+    std::vector<double>& in,
+    std::vector<std::tuple<double, double, double>>& out) {
+  out.clear();
+
+  uint32_t taps = zoom_re_.size();
+  uint32_t half = taps / 2;
+
+  std::vector<double> padded(in.size() + taps, 0.0);
+  std::copy(in.begin(), in.end(), padded.begin() + half);
+
+  // Polyphase decimation: only every decimation_-th filter output is
+  // computed, each one a contiguous dot product against the mixed taps
+  size_t len = (in.size() + decimation_ - 1) / decimation_;
+  std::vector<std::complex<double>> base(len);
+
+  double omega = M_PI * (band_lo_ + band_hi_) / sampling_rate_;
+  double step = std::fmod(omega * decimation_, 2 * M_PI);
+  double phase = 0.0;
+
+  for (size_t m = 0; m < len; m++) {
+    double const* x = padded.data() + m * decimation_;
+    double re = 0.0;
+    double im = 0.0;
+
+    for (size_t j = 0; j < taps; j++) {
+      re += zoom_re_[j] * x[j];
+      im += zoom_im_[j] * x[j];
+    }
+
+    base[m] = std::complex<double>(re, im) * std::polar(1.0, -phase);
+    phase = std::fmod(phase + step, 2 * M_PI);
+  }
+
+  double overlap = std::max(0.0, std::min(overlap_, 0.5));
+  uint32_t hop = N_ - static_cast<uint32_t>(overlap * N_);
+  size_t frames = (len + hop - 1) / hop;
+
+  std::complex<double>* fftw_in =
+      reinterpret_cast<std::complex<double>*>(fftw_in_);
+
+  double real_hop = static_cast<double>(hop) / zoom_rate_;
+  double fc = (band_lo_ + band_hi_) / 2.0;
+  double df = zoom_rate_ / N_;
+
+  out.reserve(frames * bins());
+
+  for (size_t fr = 0; fr < frames; fr++) {
+    size_t i = fr * hop;
+
+    for (size_t j = 0; j < N_; j++)
+      fftw_in[j] = i + j < len ? base[i + j] * win_h_[j] : 0.0;
+
+    fftw_execute(fftw_plan_);
+
+    for (int32_t k = zoom_k_lo_; k <= zoom_k_hi_; k++) {
+      std::complex<double> c = fftw_out_[k < 0 ? k + N_ : k];
+      double v = c.real() * c.real() + c.imag() * c.imag();
+      if (get_db_) v = 10 * std::log10(v);
+
+      out.push_back(
+          std::tuple<double, double, double>(fr * real_hop, fc + k * df, v));
+    }
+  }
+}
+
 uint32_t Transformer::N() { return N_; }
+
+uint32_t Transformer::bins() {
+  switch (mode_) {
+    case TransformMode::STFT:
+      return N_;
+    case TransformMode::REASSIGNED:
+      return N_ / 2 + 1;
+    case TransformMode::ZOOM:
+      return zoom_k_hi_ - zoom_k_lo_ + 1;
+  }
+
+  return N_;
+}
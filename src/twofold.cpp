@@ -3,19 +3,42 @@
 #include <cmath>
 #include <cstddef>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <ostream>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <utility>
 #include <vector>
 #include "audio.h"
 #include "gnuplot-iostream.h"
+#include "server.h"
 #include "transform.h"
 #include "window.h"
 
 int main(int argc, char* argv[]) {
+  if (argc >= 3 && std::strcmp(argv[1], "--serve") == 0) {
+    uint32_t workers = std::thread::hardware_concurrency();
+
+    if (argc >= 4) {
+      char* end;
+      unsigned long n = std::strtoul(argv[3], &end, 10);
+
+      if (*end != '\0' || argv[3][0] == '-' || n == 0 || n > MAX_WORKERS) {
+        printf("ERROR: Worker count must be between 1 and %u\n", MAX_WORKERS);
+        return 1;
+      }
+
+      workers = n;
+    }
+
+    Server server(argv[2], workers);
+    return server.run() ? 0 : 1;
+  }
+
   Audio<float> a;
 
   a.load("/home/acdamiani/Downloads/Alesis-Fusion-Voice-Oohs-C4.wav");
@@ -45,7 +68,7 @@ int main(int argc, char* argv[]) {
 
     dat2 << line << std::endl;
 
-    if (i % t.N() == 0 && i != 0) {
+    if (i % t.bins() == 0 && i != 0) {
       dat2 << std::endl;
     }
   }
@@ -21,3 +21,24 @@ double win_hann(double v, size_t I, size_t N) {
   _WINDOW_CHECK_IN(I, N);
   return v * 0.5 * (1 - std::cos((2 * M_PI * I) / N));
 }
+
+double dwin(WindowFunc func, double v, size_t I, size_t N) {
+  switch (func) {
+    case WindowFunc::RECTANGULAR:
+      return dwin_rectangular(v, I, N);
+    case WindowFunc::HANN:
+      return dwin_hann(v, I, N);
+  }
+
+  return 0.0;
+}
+
+double dwin_rectangular(double /* v */, size_t I, size_t N) {
+  _WINDOW_CHECK_IN(I, N);
+  return 0.0;
+}
+
+double dwin_hann(double v, size_t I, size_t N) {
+  _WINDOW_CHECK_IN(I, N);
+  return v * (M_PI / N) * std::sin((2 * M_PI * I) / N);
+}